@@ -0,0 +1,872 @@
+/*
+ * ZX-Pico RAM Emulation, a Raspberry Pi Pico based Spectrum DRAM device
+ * Copyright (C) 2025 Derek Fountain, Andrew Menadue
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Host side simulation of the ULA reading the screen out of the DRAM emulator.
+ * This runs on the PC, not the Pico.
+ *
+ * mkdir build && cd build
+ * cmake ..
+ * make
+ *
+ * ./zx_ula_sim -f 50
+ * ./zx_ula_sim -l screen.scr -f 10 -o frame
+ *
+ * The ULA's page mode fetch pattern is played into a copy of the main loop from
+ * zx_pico_fw.c, which is charged a number of Pico clock cycles for each step it
+ * takes. Each byte the ULA latches is whatever the emulator was driving onto the
+ * data bus at that moment, or random floating bus data if it wasn't driving it
+ * in time. Each frame is rendered from those bytes and compared to the screen
+ * that's actually in the store. The number of artefact pixels per frame, and
+ * where they are, is the quality measure for any change made to the loop.
+ *
+ * If the main loop in zx_pico_fw.c is changed, emulate_until() below needs the
+ * same change making, with the cycle costs adjusted to suit.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+
+/* Same as the firmware. Cycle costs below are Pico clock cycles at this speed */
+#define OVERCLOCK 360000
+
+/*
+ * GPIO layout as seen by gpio_get_all() in the firmware. Address bus in GP0-GP6,
+ * data bus in GP8-GP15, WR GP17, CAS GP18, RAS GP19.
+ */
+#define ADDR_GP_MASK   0x0000007F
+#define DBUS_ROTATE    8
+#define WR_GP_MASK     (1<<17)
+#define CAS_GP_MASK    (1<<18)
+#define RAS_GP_MASK    (1<<19)
+#define STROBE_MASK    (RAS_GP_MASK | CAS_GP_MASK)
+
+/*
+ * Cost, in Pico clock cycles, of each part of the firmware's main loop. These are
+ * calibrated against the timings noted in the comments in zx_pico_fw.c, which were
+ * measured on the scope at 360MHz: escape from the poll loop about 35ns after the
+ * strobe, data on the bus 100ns after CAS, RAS handled 60ns after RAS.
+ */
+#define POLL_LOOP_CYCLES     4   /* One pass of the edge detect loop, gpio_get_all() at the start */
+#define POLL_EXIT_CYCLES     7   /* Loop condition true through to escaping the loop */
+#define CAS_TEST_CYCLES      2   /* "This condition is 2 instructions" */
+#define WR_TEST_CYCLES       5
+#define DBUS_OUT_CYCLES      5   /* gpio_clr_mask(DIR) and gpio_set_dir_out_masked(DBUS) */
+#define DBUS_PUT_CYCLES     11   /* Store lookup and gpio_put_masked(), the slow bit */
+#define WAIT_LOOP_CYCLES     4   /* One pass of the wait-for-strobe-high loop */
+#define DBUS_IN_CYCLES       4   /* gpio_set_dir_in_masked(DBUS) and gpio_set_mask(DIR) */
+#define WRITE_CYCLES         5
+#define RAS_TEST_CYCLES      3
+#define RAS_ADDR_CYCLES      4
+#define LOOP_BACK_CYCLES     2
+
+/* GPIO input synchroniser, 2 system clock cycles before gpio_get_all() sees a change */
+#define SYNC_CYCLES          2
+
+/* Propagation delay through the SN74LVC245A level shifters, in each direction */
+#define SHIFTER_PS        4000
+
+/* Time the ULA needs data stable on the bus before it latches it */
+#define ULA_SETUP_PS      5000
+
+/*
+ * Once the level shifter lets go of the data bus the lines float, holding the last
+ * value driven for a while before it decays into rubbish. That's not been measured,
+ * so it's an option. It matters because the emulator lets go of the bus on RAS high
+ * but the ULA takes the attribute byte on CAS high, about 140ns later. Below that
+ * every attribute is lost, which the real board doesn't show.
+ */
+#define BUS_HOLD_NS        200
+
+/* Simulation time is in picoseconds. 3.5MHz Z80 T-state */
+#define TSTATE_PS       285714
+
+#define LINE_TSTATES       224
+#define GROUP_TSTATES        8
+#define GROUPS_PER_LINE     16
+
+#define SCREEN_WIDTH       256
+#define SCREEN_HEIGHT      192
+#define BYTES_PER_LINE      32
+#define ATTR_OFFSET     0x1800
+#define SCR_SIZE          6912
+
+/* 16K buffer to emulate the DRAM with, same layout as the firmware's */
+#define STORE_SIZE 16384
+uint32_t *store_ptr;
+
+/*
+ * The ULA fetches the screen in groups of 4 bytes: pixel, attribute, pixel, attribute.
+ * The pixel and attribute bytes of one character cell share the same low 7 address
+ * bits, so each pair is read in page mode: one RAS, two CASes. The second RAS comes
+ * round only about 100ns before its CAS, which is where the emulator struggles.
+ * The Z80 gets the other half of the 8 T-states; it's only modelled here as the
+ * refresh cycle it does on every M1.
+ *
+ * Timings are in picoseconds from the start of the group, read off the capture in
+ * notes/page_mode_read_fast_enough.png (100ns/div, 2ns per pixel). The address bus
+ * changes aren't on the capture, they're placed between the strobes.
+ */
+typedef enum
+{
+  ROW_ADDR,
+  COL_ADDR,
+  RAS_LOW,
+  RAS_HIGH,
+  CAS_LOW,
+  CAS_HIGH,
+  LATCH,      /* ULA takes the byte off the data bus */
+} SIGNAL;
+
+#define FETCH_PIXEL1   0
+#define FETCH_ATTR1    1
+#define FETCH_PIXEL2   2
+#define FETCH_ATTR2    3
+#define FETCH_REFRESH  4
+
+typedef struct _ula_transition
+{
+  unsigned int at_ps;
+  SIGNAL       signal;
+  unsigned int fetch;
+} ULA_TRANSITION;
+
+ULA_TRANSITION ula_transitions[] = {
+
+  {       0, ROW_ADDR, FETCH_PIXEL1 },
+  {   20000, RAS_LOW,  FETCH_PIXEL1 },
+  {   60000, COL_ADDR, FETCH_PIXEL1 },
+  {  120000, CAS_LOW,  FETCH_PIXEL1 },  /* 100ns after RAS */
+  {  324000, LATCH,    FETCH_PIXEL1 },
+  {  324000, CAS_HIGH, FETCH_PIXEL1 },  /* 204ns CAS pulse */
+
+  /* Page mode, same row */
+  {  350000, COL_ADDR, FETCH_ATTR1 },
+  {  380000, CAS_LOW,  FETCH_ATTR1 },
+  {  456000, RAS_HIGH, FETCH_ATTR1 },   /* 76ns after CAS, the emulator lets go of the bus on this */
+
+  /*
+   * On the capture RAS goes low again about 10ns before the attribute's CAS goes
+   * high, which is at the limit of what it resolves. If the Pico ever saw RAS low
+   * with CAS still low it would take the read branch and read the next pixel from
+   * the stale row, every time, and the board it was taken from is fast enough. So
+   * treat the two edges as simultaneous.
+   */
+  {  520000, ROW_ADDR, FETCH_PIXEL2 },
+  {  590000, LATCH,    FETCH_ATTR1  },
+  {  590000, CAS_HIGH, FETCH_ATTR1  },
+  {  590000, RAS_LOW,  FETCH_PIXEL2 },  /* 570ns RAS period */
+  {  630000, COL_ADDR, FETCH_PIXEL2 },
+  {  684000, CAS_LOW,  FETCH_PIXEL2 },  /* The tight one, 94ns after RAS */
+  {  894000, LATCH,    FETCH_PIXEL2 },
+  {  894000, CAS_HIGH, FETCH_PIXEL2 },
+
+  {  920000, COL_ADDR, FETCH_ATTR2 },
+  {  950000, CAS_LOW,  FETCH_ATTR2 },
+  { 1030000, RAS_HIGH, FETCH_ATTR2 },
+  { 1170000, LATCH,    FETCH_ATTR2 },
+  { 1170000, CAS_HIGH, FETCH_ATTR2 },
+
+  /* A refresh from the Z80's half of the group */
+  { 1400000, ROW_ADDR, FETCH_REFRESH },
+  { 1450000, RAS_LOW,  FETCH_REFRESH },
+  { 1700000, RAS_HIGH, FETCH_REFRESH },
+};
+#define NUM_ULA_TRANSITIONS (sizeof(ula_transitions)/sizeof(ula_transitions[0]))
+
+/* The waveform the ULA puts on the pins for one line, as seen from the Pico */
+typedef struct _wave_step
+{
+  int64_t  at_ps;
+  uint32_t gpios;
+} WAVE_STEP;
+
+#define MAX_WAVE_STEPS (GROUPS_PER_LINE*NUM_ULA_TRANSITIONS+1)
+WAVE_STEP wave[MAX_WAVE_STEPS];
+uint32_t  num_wave_steps;
+uint32_t  wave_index;
+
+/* The moments in the line the ULA latches a byte, and what it ought to get */
+typedef struct _ula_latch
+{
+  int64_t  at_ps;
+  uint16_t zx_addr;
+  uint8_t  fetched;
+  uint8_t  held;      /* Came off the floating bus after the emulator let go */
+} ULA_LATCH;
+
+#define LATCHES_PER_LINE (GROUPS_PER_LINE*4)
+ULA_LATCH latches[LATCHES_PER_LINE];
+
+/* Spans of time the emulator drives the data bus towards the ZX */
+typedef struct _dbus_drive
+{
+  int64_t  from_ps;
+  int64_t  to_ps;
+  uint8_t  value;
+} DBUS_DRIVE;
+
+/*
+ * A drive starts once per strobe falling edge the emulator spots, and there's at
+ * most one of those per step in the line's waveform
+ */
+#define MAX_DRIVES MAX_WAVE_STEPS
+DBUS_DRIVE drives[MAX_DRIVES];
+uint32_t   num_drives;
+
+/* Simulation state */
+int64_t  now_ps;
+int64_t  cycle_ps;
+double   stall_rate     = 0.0005;
+unsigned int stall_cycles = 24;
+int64_t  bus_hold_ps    = BUS_HOLD_NS*1000;
+uint32_t seed           = 1;
+uint8_t  refresh_row    = 0;
+
+/* Emulator state which carries over from one line to the next */
+uint32_t previous_gpios = STROBE_MASK;
+uint16_t addr_requested = 0;
+
+
+/*
+ * Separate random streams for stalls, floating bus data and frame phase, so
+ * a change to the loop which alters how many stall rolls there are doesn't
+ * reshuffle the others. Runs with the same seed can then be compared.
+ */
+uint32_t stall_rand_state;
+uint32_t bus_rand_state;
+uint32_t phase_rand_state;
+
+/* xorshift32, repeatable for a given seed so runs can be compared */
+static uint32_t sim_rand( uint32_t *state )
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+/* Spread the seed out so each stream starts somewhere different, never at 0 */
+static uint32_t seed_stream( uint32_t stream )
+{
+  uint32_t state = (seed + stream) * 0x9E3779B9u;
+
+  state ^= state >> 16;
+  state *= 0x85EBCA6Bu;
+  state ^= state >> 13;
+
+  return state ? state : 1;
+}
+
+/*
+ * The ZX puts the low 7 bits of the address out with RAS and the high 7 bits with
+ * CAS. The firmware keeps its store as row*128+column.
+ */
+static uint16_t store_index( uint16_t zx_addr )
+{
+  return (uint16_t)(((zx_addr & 0x7F) << 7) | ((zx_addr >> 7) & 0x7F));
+}
+
+static uint8_t store_byte( uint16_t zx_addr )
+{
+  return (uint8_t)(*(store_ptr+store_index(zx_addr)) >> DBUS_ROTATE);
+}
+
+/* Offset into lower RAM of the pixel byte for column x (0-31), line y (0-191) */
+static uint16_t pixel_addr( unsigned int x, unsigned int y )
+{
+  return (uint16_t)(((y & 0xC0) << 5) | ((y & 0x07) << 8) | ((y & 0x38) << 2) | x);
+}
+
+static uint16_t attr_addr( unsigned int x, unsigned int y )
+{
+  return (uint16_t)(ATTR_OFFSET + (y >> 3)*BYTES_PER_LINE + x);
+}
+
+/*
+ * Time passes on the Pico. Each cycle has a small chance of being held up,
+ * standing in for bus and XIP stalls. It's rolled per cycle so that how the
+ * loop is split into spend() calls doesn't change the result. The stall is
+ * counted in cycles too, the flash clock being divided down from the system
+ * clock, so a faster Pico recovers from one sooner.
+ */
+static void spend( unsigned int cycles )
+{
+  now_ps += cycles * cycle_ps;
+
+  if( stall_rate > 0.0 )
+  {
+    while( cycles-- )
+    {
+      if( (sim_rand( &stall_rand_state ) / 4294967296.0) < stall_rate )
+	now_ps += stall_cycles * cycle_ps;
+    }
+  }
+}
+
+static uint32_t sim_gpio_get_all( void )
+{
+  int64_t seen_ps = now_ps - SHIFTER_PS - SYNC_CYCLES*cycle_ps;
+
+  while( wave_index+1 < num_wave_steps && wave[wave_index+1].at_ps <= seen_ps )
+    wave_index++;
+
+  return wave[wave_index].gpios;
+}
+
+static void sim_dbus_drive( uint8_t value )
+{
+  if( num_drives == MAX_DRIVES )
+  {
+    fprintf( stderr, "Data bus drive log overflowed, %u drives in one line\n", (unsigned int)MAX_DRIVES );
+    exit( 1 );
+  }
+
+  drives[num_drives].from_ps = now_ps + SHIFTER_PS;
+  drives[num_drives].to_ps   = INT64_MAX;
+  drives[num_drives].value   = value;
+  num_drives++;
+}
+
+static void sim_dbus_release( void )
+{
+  if( num_drives > 0 )
+    drives[num_drives-1].to_ps = now_ps + SHIFTER_PS;
+}
+
+/*
+ * Build the ULA's pin waveform and latch points for screen line y, starting
+ * at line_ps.
+ */
+static void build_line( unsigned int y, int64_t line_ps )
+{
+  uint32_t gpios = RAS_GP_MASK | CAS_GP_MASK | WR_GP_MASK;
+  unsigned int group;
+  unsigned int i;
+
+  num_wave_steps = 0;
+  wave_index     = 0;
+
+  wave[num_wave_steps].at_ps = INT64_MIN;
+  wave[num_wave_steps].gpios = gpios;
+  num_wave_steps++;
+
+  for( group=0; group<GROUPS_PER_LINE; group++ )
+  {
+    int64_t  group_ps = line_ps + (int64_t)group*GROUP_TSTATES*TSTATE_PS;
+    uint16_t addrs[5];
+
+    addrs[FETCH_PIXEL1]  = pixel_addr( group*2,   y );
+    addrs[FETCH_ATTR1]   = attr_addr(  group*2,   y );
+    addrs[FETCH_PIXEL2]  = pixel_addr( group*2+1, y );
+    addrs[FETCH_ATTR2]   = attr_addr(  group*2+1, y );
+    addrs[FETCH_REFRESH] = refresh_row++ & 0x7F;
+
+    for( i=0; i<NUM_ULA_TRANSITIONS; i++ )
+    {
+      ULA_TRANSITION *t = &ula_transitions[i];
+      int64_t at_ps     = group_ps + t->at_ps;
+
+      switch( t->signal )
+      {
+      case ROW_ADDR: gpios = (gpios & ~ADDR_GP_MASK) | (addrs[t->fetch] & 0x7F);        break;
+      case COL_ADDR: gpios = (gpios & ~ADDR_GP_MASK) | ((addrs[t->fetch] >> 7) & 0x7F); break;
+      case RAS_LOW:  gpios &= ~RAS_GP_MASK;                                             break;
+      case RAS_HIGH: gpios |=  RAS_GP_MASK;                                             break;
+      case CAS_LOW:  gpios &= ~CAS_GP_MASK;                                             break;
+      case CAS_HIGH: gpios |=  CAS_GP_MASK;                                             break;
+      case LATCH:
+	latches[group*4+t->fetch].at_ps   = at_ps;
+	latches[group*4+t->fetch].zx_addr = addrs[t->fetch];
+	continue;
+      }
+
+      wave[num_wave_steps].at_ps = at_ps;
+      wave[num_wave_steps].gpios = gpios;
+      num_wave_steps++;
+    }
+  }
+}
+
+/*
+ * The main loop from zx_pico_fw.c, with time charged for each step and the
+ * GPIO calls replaced with the simulated ones. Runs until the simulated time
+ * reaches until_ps with the emulator sitting waiting for a strobe.
+ */
+static void emulate_until( int64_t until_ps )
+{
+  uint32_t gpios_state;
+
+  while(1)
+  {
+    while( (previous_gpios & ( ~((gpios_state = sim_gpio_get_all())) & STROBE_MASK )) == 0 )
+    {
+      previous_gpios = gpios_state;
+      spend( POLL_LOOP_CYCLES );
+
+      if( now_ps >= until_ps )
+	return;
+    }
+    spend( POLL_EXIT_CYCLES );
+
+    spend( CAS_TEST_CYCLES );
+    if( ((gpios_state & CAS_GP_MASK) == 0) )
+    {
+      spend( WR_TEST_CYCLES );
+      if( gpios_state & WR_GP_MASK )
+      {
+	/* gpio_clr_mask(DIR_GP_MASK), gpio_set_dir_out_masked( DBUS_GP_MASK ) */
+	spend( DBUS_OUT_CYCLES );
+
+	/* gpio_put_masked( DBUS_GP_MASK, ... ) */
+	spend( DBUS_PUT_CYCLES );
+	sim_dbus_drive( (uint8_t)(*(store_ptr+(addr_requested + (uint8_t)(gpios_state & ADDR_GP_MASK))) >> DBUS_ROTATE) );
+
+	while( ((previous_gpios=sim_gpio_get_all()) & STROBE_MASK) == 0 )
+	  spend( WAIT_LOOP_CYCLES );
+
+	/* gpio_set_dir_in_masked( DBUS_GP_MASK ), gpio_set_mask(DIR_GP_MASK) */
+	spend( DBUS_IN_CYCLES );
+	sim_dbus_release();
+
+	continue;
+      }
+      else
+      {
+        addr_requested += (uint8_t)(gpios_state & ADDR_GP_MASK);
+	*(store_ptr+addr_requested) = gpios_state;
+	spend( WRITE_CYCLES );
+      }
+    }
+    else
+    {
+      spend( RAS_TEST_CYCLES );
+      if( (gpios_state & RAS_GP_MASK) == 0 )
+      {
+	addr_requested = (uint16_t)(128 * (uint8_t)(gpios_state & ADDR_GP_MASK));
+	spend( RAS_ADDR_CYCLES );
+      }
+    }
+
+    previous_gpios = gpios_state & STROBE_MASK;
+    spend( LOOP_BACK_CYCLES );
+  }
+}
+
+/*
+ * Work out what the ULA actually latched for each fetch in the line. That's the
+ * last value the emulator drove, if it got there in time and the bus hasn't
+ * decayed since, otherwise floating bus rubbish. Returns the smallest slack
+ * good data had before the ULA's setup time, counting only reads made while
+ * the emulator was still driving, INT64_MAX if there were none.
+ */
+static int64_t resolve_latches( void )
+{
+  int64_t      worst_ps = INT64_MAX;
+  unsigned int i, d;
+
+  for( i=0; i<LATCHES_PER_LINE; i++ )
+  {
+    ULA_LATCH  *l     = &latches[i];
+    DBUS_DRIVE *drive = NULL;
+
+    for( d=0; d<num_drives; d++ )
+    {
+      if( drives[d].from_ps + ULA_SETUP_PS <= l->at_ps )
+	drive = &drives[d];
+    }
+
+    if( drive != NULL && drive->to_ps != INT64_MAX && l->at_ps >= drive->to_ps + bus_hold_ps )
+      drive = NULL;
+
+    l->held = 0;
+    if( drive != NULL )
+    {
+      l->fetched = drive->value;
+      l->held    = (l->at_ps >= drive->to_ps);
+
+      /* Reads off the held bus latched after the drive ended, they've no margin to speak of */
+      if( !l->held && l->fetched == store_byte( l->zx_addr ) && l->at_ps - drive->from_ps - ULA_SETUP_PS < worst_ps )
+	worst_ps = l->at_ps - drive->from_ps - ULA_SETUP_PS;
+    }
+    else
+    {
+      l->fetched = (uint8_t)sim_rand( &bus_rand_state );
+    }
+  }
+
+  return worst_ps;
+}
+
+/* Spectrum palette, index 0-7 normal, 8-15 bright */
+static void colour_rgb( uint8_t colour, uint8_t *rgb )
+{
+  uint8_t level = (colour & 0x08) ? 0xFF : 0xD7;
+
+  rgb[0] = (colour & 0x02) ? level : 0;
+  rgb[1] = (colour & 0x04) ? level : 0;
+  rgb[2] = (colour & 0x01) ? level : 0;
+}
+
+/* Expand a pixel byte and its attribute into 8 palette indices */
+static void render_cell( uint8_t pixels, uint8_t attr, unsigned int frame, uint8_t *out )
+{
+  uint8_t ink    = (attr & 0x07) | ((attr & 0x40) >> 3);
+  uint8_t paper  = ((attr >> 3) & 0x07) | ((attr & 0x40) >> 3);
+  unsigned int b;
+
+  /* FLASH swaps ink and paper every 16 frames */
+  if( (attr & 0x80) && (frame & 0x10) )
+  {
+    uint8_t swap = ink;
+    ink = paper;
+    paper = swap;
+  }
+
+  for( b=0; b<8; b++ )
+    out[b] = (pixels & (0x80>>b)) ? ink : paper;
+}
+
+static int write_ppm( const char *filename, uint8_t *screen, uint8_t *highlight )
+{
+  FILE *fp = fopen( filename, "wb" );
+  unsigned int i;
+
+  if( fp == NULL )
+  {
+    perror( filename );
+    return -1;
+  }
+
+  fprintf( fp, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT );
+  for( i=0; i<SCREEN_WIDTH*SCREEN_HEIGHT; i++ )
+  {
+    uint8_t rgb[3];
+
+    colour_rgb( screen[i], rgb );
+
+    /* Artefacts in magenta over a dimmed copy of the screen */
+    if( highlight != NULL )
+    {
+      if( highlight[i] )
+      {
+	rgb[0] = 0xFF; rgb[1] = 0x00; rgb[2] = 0xFF;
+      }
+      else
+      {
+	rgb[0] /= 4; rgb[1] /= 4; rgb[2] /= 4;
+      }
+    }
+
+    fwrite( rgb, 1, 3, fp );
+  }
+  fclose( fp );
+
+  return 0;
+}
+
+/* Something with plenty of detail in it, used if no .scr file is given */
+static void fill_test_screen( uint8_t *scr )
+{
+  unsigned int x, y;
+
+  for( y=0; y<SCREEN_HEIGHT; y++ )
+    for( x=0; x<BYTES_PER_LINE; x++ )
+      scr[pixel_addr(x,y)] = (uint8_t)((y & 1) ? (0x55u << (x & 1)) : (x*8 + y));
+
+  for( y=0; y<SCREEN_HEIGHT/8; y++ )
+    for( x=0; x<BYTES_PER_LINE; x++ )
+      scr[attr_addr(x,y*8)] = (uint8_t)((((x+y) & 0x07) << 3) | (7 - ((x+y) & 0x07)) | ((y & 4) << 4));
+}
+
+/* Whole number from the command line in min-max, returns 0 if it's not */
+static int parse_uint( const char *str, unsigned long min, unsigned long max, unsigned long *value )
+{
+  char *end;
+
+  while( isspace( (unsigned char)*str ) )
+    str++;
+
+  /* strtoul() quietly accepts and wraps negative numbers */
+  if( *str == '-' )
+    return 0;
+
+  errno  = 0;
+  *value = strtoul( str, &end, 0 );
+
+  return errno == 0 && end != str && *end == '\0' && *value >= min && *value <= max;
+}
+
+static int parse_double( const char *str, double min, double max, double *value )
+{
+  char *end;
+
+  errno  = 0;
+  *value = strtod( str, &end );
+
+  return errno == 0 && end != str && *end == '\0' && *value >= min && *value <= max;
+}
+
+/* Margin in ns, or n/a if there wasn't a good read to take it from */
+static const char *margin_str( int64_t margin_ps, char *buf, size_t len )
+{
+  if( margin_ps == INT64_MAX )
+    snprintf( buf, len, "n/a" );
+  else
+    snprintf( buf, len, "%.1fns", margin_ps/1000.0 );
+
+  return buf;
+}
+
+static void usage( const char *prog )
+{
+  fprintf( stderr,
+	   "Usage: %s [-l screen.scr] [-f frames] [-o prefix] [-s seed]\n"
+	   "          [-c clock_khz] [-p stall_rate] [-t stall_cycles]\n"
+	   "          [-b bus_hold_ns] [-q]\n"
+	   "  -l  Load a 6912 byte .scr file into the store, default is a test pattern\n"
+	   "  -f  Number of frames to simulate, 1-1000000, default 10\n"
+	   "  -o  Write prefix_true.ppm, and prefix_NNNN.ppm and prefix_NNNN_diff.ppm per frame\n"
+	   "  -s  Random seed, default 1\n"
+	   "  -c  Pico clock in kHz, 1000-1000000, default %d\n"
+	   "  -p  Chance of a stall per Pico cycle, 0-1, default %g\n"
+	   "  -t  Length of a stall in Pico cycles, default %u\n"
+	   "  -b  How long the floating bus holds the last value driven, in ns, default %d\n"
+	   "  -q  Don't list artefact positions, summary only\n",
+	   prog, OVERCLOCK, stall_rate, stall_cycles, BUS_HOLD_NS );
+}
+
+int main( int argc, char *argv[] )
+{
+  const char  *scr_filename = NULL;
+  const char  *out_prefix   = NULL;
+  unsigned int num_frames   = 10;
+  unsigned int clock_khz    = OVERCLOCK;
+  int          quiet        = 0;
+  int          ok           = 1;
+  int          opt;
+  unsigned long ul_value;
+  double        d_value;
+
+  while( (opt = getopt( argc, argv, "l:f:o:s:c:p:t:b:q" )) != -1 )
+  {
+    switch( opt )
+    {
+    case 'l': scr_filename = optarg;                                  break;
+    case 'f':
+      ok = parse_uint( optarg, 1, 1000000, &ul_value );
+      num_frames = (unsigned int)ul_value;
+      break;
+    case 'o': out_prefix   = optarg;                                  break;
+    case 's':
+      ok = parse_uint( optarg, 0, UINT32_MAX, &ul_value );
+      seed = (uint32_t)ul_value;
+      break;
+    case 'c':
+      ok = parse_uint( optarg, 1000, 1000000, &ul_value );
+      clock_khz = (unsigned int)ul_value;
+      break;
+    case 'p':
+      ok = parse_double( optarg, 0.0, 1.0, &d_value );
+      stall_rate = d_value;
+      break;
+    case 't':
+      ok = parse_uint( optarg, 0, 100000, &ul_value );
+      stall_cycles = (unsigned int)ul_value;
+      break;
+    case 'b':
+      ok = parse_uint( optarg, 0, 1000000, &ul_value );
+      bus_hold_ps = (int64_t)ul_value*1000;
+      break;
+    case 'q': quiet        = 1;                                       break;
+    default:
+      ok = 0;
+      break;
+    }
+
+    if( !ok )
+    {
+      usage( argv[0] );
+      return 1;
+    }
+  }
+
+  stall_rand_state = seed_stream( 0 );
+  bus_rand_state   = seed_stream( 1 );
+  phase_rand_state = seed_stream( 2 );
+
+  cycle_ps = 1000000000LL / clock_khz;
+
+  /* Screen memory as the ZX sees it, first 6912 bytes of lower RAM */
+  uint8_t scr[SCR_SIZE];
+  memset( scr, 0, sizeof(scr) );
+
+  if( scr_filename != NULL )
+  {
+    FILE *fp = fopen( scr_filename, "rb" );
+
+    if( fp == NULL )
+    {
+      perror( scr_filename );
+      return 1;
+    }
+    if( fread( scr, 1, SCR_SIZE, fp ) != SCR_SIZE )
+    {
+      fprintf( stderr, "%s: not a %d byte screen file\n", scr_filename, SCR_SIZE );
+      fclose( fp );
+      return 1;
+    }
+    fclose( fp );
+  }
+  else
+  {
+    fill_test_screen( scr );
+  }
+
+  /* Populate the store the way the firmware's write path would have */
+  store_ptr = calloc( STORE_SIZE, sizeof(uint32_t) );
+  if( store_ptr == NULL )
+  {
+    fprintf( stderr, "Out of memory\n" );
+    return 1;
+  }
+
+  uint16_t zx_addr;
+  for( zx_addr=0; zx_addr<SCR_SIZE; zx_addr++ )
+    *(store_ptr+store_index(zx_addr)) = (uint32_t)scr[zx_addr] << DBUS_ROTATE;
+
+  static uint8_t true_screen[SCREEN_WIDTH*SCREEN_HEIGHT];
+  static uint8_t sim_screen[SCREEN_WIDTH*SCREEN_HEIGHT];
+  static uint8_t artefacts[SCREEN_WIDTH*SCREEN_HEIGHT];
+
+  char         filename[1024];
+  char         margin[32];
+  unsigned int frame;
+  unsigned long total_pixels = 0;
+  unsigned long total_bad    = 0;
+  unsigned long total_held   = 0;
+  int64_t       overall_worst_ps = INT64_MAX;
+
+  now_ps = 0;
+
+  for( frame=0; frame<num_frames; frame++ )
+  {
+    unsigned int  y, x;
+    unsigned int  frame_pixels = 0;
+    unsigned int  frame_bad    = 0;
+    unsigned int  frame_held   = 0;
+    int64_t       worst_ps     = INT64_MAX;
+
+    /* The frame starts at some arbitrary phase relative to the Pico's loop */
+    int64_t line_ps = now_ps + (sim_rand( &phase_rand_state ) % (uint32_t)TSTATE_PS);
+
+    for( y=0; y<SCREEN_HEIGHT; y++ )
+    {
+      int64_t line_worst_ps;
+
+      build_line( y, line_ps );
+      num_drives = 0;
+
+      /* Nothing happens between lines, skip over it keeping the poll loop phase */
+      if( now_ps < line_ps - TSTATE_PS )
+	now_ps += ((line_ps - TSTATE_PS - now_ps) / (POLL_LOOP_CYCLES*cycle_ps)) * (POLL_LOOP_CYCLES*cycle_ps);
+
+      emulate_until( line_ps + (int64_t)GROUPS_PER_LINE*GROUP_TSTATES*TSTATE_PS );
+
+      line_worst_ps = resolve_latches();
+      if( line_worst_ps < worst_ps )
+	worst_ps = line_worst_ps;
+
+      for( x=0; x<BYTES_PER_LINE; x++ )
+      {
+	ULA_LATCH   *pixel_latch = &latches[(x/2)*4 + (x&1)*2];
+	ULA_LATCH   *attr_latch  = pixel_latch+1;
+	uint8_t     *true_cell   = &true_screen[y*SCREEN_WIDTH + x*8];
+	uint8_t     *sim_cell    = &sim_screen[y*SCREEN_WIDTH + x*8];
+	unsigned int cell_pixels = 0;
+	unsigned int b;
+
+	render_cell( store_byte( pixel_latch->zx_addr ), store_byte( attr_latch->zx_addr ), frame, true_cell );
+	render_cell( pixel_latch->fetched, attr_latch->fetched, frame, sim_cell );
+
+	if( pixel_latch->fetched != store_byte( pixel_latch->zx_addr ) )
+	  frame_bad++;
+	else if( pixel_latch->held )
+	  frame_held++;
+	if( attr_latch->fetched != store_byte( attr_latch->zx_addr ) )
+	  frame_bad++;
+	else if( attr_latch->held )
+	  frame_held++;
+
+	for( b=0; b<8; b++ )
+	{
+	  artefacts[y*SCREEN_WIDTH + x*8 + b] = (true_cell[b] != sim_cell[b]);
+	  cell_pixels += artefacts[y*SCREEN_WIDTH + x*8 + b];
+	}
+	frame_pixels += cell_pixels;
+
+	if( cell_pixels && !quiet )
+	  printf( "  frame %u: %u artefact pixels at x=%u-%u y=%u\n",
+		  frame, cell_pixels, x*8, x*8+7, y );
+      }
+
+      line_ps += (int64_t)LINE_TSTATES*TSTATE_PS;
+    }
+
+    printf( "frame %u: %u artefact pixels, %u bad reads of %u, %u good only off the held bus, worst margin %s\n",
+	    frame, frame_pixels, frame_bad, SCREEN_HEIGHT*LATCHES_PER_LINE, frame_held,
+	    margin_str( worst_ps, margin, sizeof(margin) ) );
+
+    total_pixels += frame_pixels;
+    total_bad    += frame_bad;
+    total_held   += frame_held;
+    if( worst_ps < overall_worst_ps )
+      overall_worst_ps = worst_ps;
+
+    if( out_prefix != NULL )
+    {
+      if( frame == 0 )
+      {
+	snprintf( filename, sizeof(filename), "%s_true.ppm", out_prefix );
+	write_ppm( filename, true_screen, NULL );
+      }
+      snprintf( filename, sizeof(filename), "%s_%04u.ppm", out_prefix, frame );
+      write_ppm( filename, sim_screen, NULL );
+      snprintf( filename, sizeof(filename), "%s_%04u_diff.ppm", out_prefix, frame );
+      write_ppm( filename, true_screen, artefacts );
+    }
+
+    /* Rest of the frame is border and retrace, 312 lines in all */
+    now_ps = line_ps + (int64_t)(312-SCREEN_HEIGHT)*LINE_TSTATES*TSTATE_PS;
+  }
+
+  if( num_frames > 0 )
+    printf( "%u frames: %.1f artefact pixels per frame, %.1f bad reads per frame, %.1f good only off the held bus, worst margin %s\n",
+	    num_frames, (double)total_pixels/num_frames, (double)total_bad/num_frames, (double)total_held/num_frames,
+	    margin_str( overall_worst_ps, margin, sizeof(margin) ) );
+
+  free( store_ptr );
+
+  return 0;
+}